@@ -0,0 +1,328 @@
+#include <Arduino.h>
+#include <Preferences.h>
+#include "deskcalibrator.h"
+
+// Where the measured profile lives in NVS.
+#define PROFILE_NAMESPACE "desksniffer"
+#define PROFILE_KEY "profile"
+#define PROFILE_VERSION_KEY "version"
+// Bump this whenever the layout or meaning of DeskProfile changes, so profiles
+// written by older firmware are ignored instead of misread.
+#define PROFILE_VERSION 1
+
+// How far each test move travels. The desk goes up this far and then back down.
+#define CALIBRATION_TRAVEL_MM 150
+// The display reads to 1mm below 1000, but only in steps of 10mm above it, so
+// both test moves have to stay below this height to measure anything useful.
+#define CALIBRATION_PRECISE_MAX_MM 1000
+// Room left above the up move for the desk to coast into.
+#define CALIBRATION_COAST_ALLOWANCE_MM 30
+// The up move has to start at or below this height to stay in the precise range.
+// If the desk is any higher, it is driven down to here first.
+#define CALIBRATION_START_MAX_MM (CALIBRATION_PRECISE_MAX_MM - CALIBRATION_TRAVEL_MM - CALIBRATION_COAST_ALLOWANCE_MM)
+// How long the desk gets to start moving after a button press before we give up.
+#define CALIBRATION_RESPONSE_TIMEOUT_MS 3000
+// If the height stops changing for this long while the button is held, the desk
+// has hit the end of its travel.
+#define CALIBRATION_STALL_MS 1500
+// Cycles of unchanged height after releasing the button before we consider the
+// desk to have stopped coasting.
+#define CALIBRATION_SETTLE_CYCLES 40
+
+DeskCalibrator::DeskCalibrator(DeskMover &deskMover)
+    : deskMover(deskMover),
+      phase(IDLE),
+      failReason(""),
+      pass(0),
+      cycles(0),
+      lastChangeCycle(0),
+      pressMs(0),
+      firstMoveMs(0),
+      lastChangeMs(0),
+      prevHeight(0),
+      firstMoveHeight(0),
+      releaseHeight(0)
+{
+}
+
+// Loads a previously measured profile from NVS. Returns false if there isn't
+// one, or if it was written for a different version of DeskProfile.
+bool DeskCalibrator::loadProfile(DeskProfile &profile)
+{
+    Preferences prefs;
+    prefs.begin(PROFILE_NAMESPACE, true);
+    bool found = prefs.getUChar(PROFILE_VERSION_KEY, 0) == PROFILE_VERSION &&
+                 prefs.getBytesLength(PROFILE_KEY) == sizeof(DeskProfile);
+    if (found)
+        prefs.getBytes(PROFILE_KEY, &profile, sizeof(DeskProfile));
+    prefs.end();
+    return found;
+}
+
+void DeskCalibrator::saveProfile(const DeskProfile &profile)
+{
+    Preferences prefs;
+    prefs.begin(PROFILE_NAMESPACE, false);
+    prefs.putBytes(PROFILE_KEY, &profile, sizeof(DeskProfile));
+    prefs.putUChar(PROFILE_VERSION_KEY, PROFILE_VERSION);
+    prefs.end();
+}
+
+// Requests a calibration run. This is safe to call from an HTTP handler, as the
+// actual work happens the next time handle is called from the control loop.
+// Returns false if a calibration is already running.
+bool DeskCalibrator::start()
+{
+    if (isRunning())
+        return false;
+    phase = STARTING;
+    return true;
+}
+
+// Stops a running calibration, leaving the current profile untouched.
+void DeskCalibrator::abort()
+{
+    if (!isRunning())
+        return;
+    deskMover.haltMovement();
+    fail("aborted");
+}
+
+bool DeskCalibrator::isRunning()
+{
+    return phase == STARTING || phase == POSITIONING || phase == SETTLING || phase == PRESSING || phase == COASTING;
+}
+
+// To be called repeatedly in the loop function while a calibration is running.
+// Returns true until the calibration has either finished or failed.
+bool DeskCalibrator::handle(uint16_t currHeight)
+{
+    switch (phase)
+    {
+    case STARTING:
+        Serial.println("Calibration started at " + String(currHeight) + "mm");
+        measured = DeskProfile();
+        // A measured profile lets go where the desk will coast to the target,
+        // so only moves shorter than the coast are made by pulsing the button.
+        measured.slowZoneMm = 0;
+        measured.settleCycles = 10;
+        pass = 0;
+        if (currHeight > CALIBRATION_START_MAX_MM)
+            beginPositioning(currHeight);
+        else
+            beginPass(currHeight);
+        break;
+    case POSITIONING:
+        position(currHeight);
+        break;
+    case SETTLING:
+        settle(currHeight);
+        break;
+    case PRESSING:
+        press(currHeight);
+        break;
+    case COASTING:
+        coast(currHeight);
+        break;
+    default:
+        break;
+    }
+    return isRunning();
+}
+
+// Returns the state of the calibration and the profile currently in use as JSON.
+String DeskCalibrator::status()
+{
+    String state;
+    switch (phase)
+    {
+    case IDLE:
+        state = "idle";
+        break;
+    case DONE:
+        state = "done";
+        break;
+    case FAILED:
+        state = "failed: " + String(failReason);
+        break;
+    default:
+        state = "running";
+        break;
+    }
+
+    const DeskProfile &profile = deskMover.getProfile();
+    String json = "{\"state\":\"" + state + "\"";
+    const char *names[] = {"up", "down"};
+    const DeskProfile::Direction *dirs[] = {&profile.up, &profile.down};
+    for (int i = 0; i < 2; i++)
+    {
+        json += ",\"" + String(names[i]) + "\":{";
+        json += "\"speed\":" + String(dirs[i]->speed / 10.0, 1);
+        json += ",\"startLagMs\":" + String(dirs[i]->startLagMs);
+        json += ",\"coastMm\":" + String(dirs[i]->coastMm) + "}";
+    }
+    json += ",\"settleCycles\":" + String(profile.settleCycles) + "}";
+    return json;
+}
+
+// The first pass goes up, the second one comes back down.
+bool DeskCalibrator::passIsUp()
+{
+    return pass == 0;
+}
+
+DeskProfile::Direction &DeskCalibrator::passDirection()
+{
+    return passIsUp() ? measured.up : measured.down;
+}
+
+// Lowers the desk far enough that the test moves stay in the range where the
+// display reads to the mm.
+void DeskCalibrator::beginPositioning(uint16_t currHeight)
+{
+    Serial.println("Lowering desk to " + String(CALIBRATION_START_MAX_MM) + "mm for calibration");
+    pressMs = millis();
+    prevHeight = currHeight;
+    phase = POSITIONING;
+    deskMover.holdButton(false);
+}
+
+void DeskCalibrator::position(uint16_t currHeight)
+{
+    unsigned long now = millis();
+    if (currHeight != prevHeight)
+    {
+        prevHeight = currHeight;
+        pressMs = now;
+    }
+    else if (now - pressMs > CALIBRATION_RESPONSE_TIMEOUT_MS)
+    {
+        deskMover.haltMovement();
+        fail("desk did not respond");
+        return;
+    }
+
+    if (currHeight > CALIBRATION_START_MAX_MM)
+        return;
+
+    deskMover.haltMovement();
+    cycles = 0;
+    lastChangeCycle = 0;
+    phase = SETTLING;
+}
+
+// Waits for the desk to come to rest after positioning, so that the first test
+// move starts from standstill.
+void DeskCalibrator::settle(uint16_t currHeight)
+{
+    cycles++;
+    if (currHeight != prevHeight)
+    {
+        prevHeight = currHeight;
+        lastChangeCycle = cycles;
+    }
+    if (cycles - lastChangeCycle < CALIBRATION_SETTLE_CYCLES)
+        return;
+
+    if (currHeight > CALIBRATION_START_MAX_MM)
+        beginPositioning(currHeight);
+    else
+        beginPass(currHeight);
+}
+
+void DeskCalibrator::beginPass(uint16_t currHeight)
+{
+    Serial.println(passIsUp() ? "Calibrating up" : "Calibrating down");
+    pressMs = millis();
+    prevHeight = currHeight;
+    firstMoveHeight = 0;
+    phase = PRESSING;
+    deskMover.holdButton(passIsUp());
+}
+
+// Holds the button down, noting when the desk starts moving and how far it has
+// gone, until it has travelled far enough to get a decent speed measurement.
+void DeskCalibrator::press(uint16_t currHeight)
+{
+    unsigned long now = millis();
+    if (currHeight != prevHeight)
+    {
+        prevHeight = currHeight;
+        lastChangeMs = now;
+        if (firstMoveHeight == 0)
+        {
+            firstMoveHeight = currHeight;
+            firstMoveMs = now;
+        }
+    }
+
+    if (firstMoveHeight == 0)
+    {
+        if (now - pressMs > CALIBRATION_RESPONSE_TIMEOUT_MS)
+        {
+            deskMover.haltMovement();
+            fail("desk did not respond");
+        }
+        return;
+    }
+
+    uint16_t travelled = abs(currHeight - firstMoveHeight);
+    if (travelled < CALIBRATION_TRAVEL_MM && now - lastChangeMs < CALIBRATION_STALL_MS)
+        return;
+
+    deskMover.haltMovement();
+    unsigned long elapsedMs = lastChangeMs - firstMoveMs;
+    if (travelled < 20 || elapsedMs == 0)
+    {
+        fail("desk did not travel far enough");
+        return;
+    }
+
+    DeskProfile::Direction &dir = passDirection();
+    dir.speed = travelled * 10 * 1000UL / elapsedMs;
+    dir.startLagMs = firstMoveMs - pressMs;
+    releaseHeight = currHeight;
+    cycles = 0;
+    lastChangeCycle = 0;
+    phase = COASTING;
+}
+
+// Waits for the desk to stop after the button was released, measuring how far
+// it went and how long it took.
+void DeskCalibrator::coast(uint16_t currHeight)
+{
+    cycles++;
+    if (currHeight != prevHeight)
+    {
+        prevHeight = currHeight;
+        lastChangeCycle = cycles;
+    }
+    if (cycles - lastChangeCycle < CALIBRATION_SETTLE_CYCLES)
+        return;
+
+    DeskProfile::Direction &dir = passDirection();
+    dir.coastMm = min(abs(currHeight - releaseHeight), 255);
+    measured.settleCycles = constrain(max((int)measured.settleCycles, lastChangeCycle + 10), 10, 255);
+    Serial.println("Speed: " + String(dir.speed / 10.0, 1) + "mm/s, lag: " + String(dir.startLagMs) +
+                   "ms, coast: " + String(dir.coastMm) + "mm");
+
+    if (++pass < 2)
+        beginPass(currHeight);
+    else
+        finish();
+}
+
+void DeskCalibrator::finish()
+{
+    deskMover.setProfile(measured);
+    saveProfile(measured);
+    phase = DONE;
+    Serial.println("Calibration done, settle cycles: " + String(measured.settleCycles));
+}
+
+void DeskCalibrator::fail(const char *reason)
+{
+    failReason = reason;
+    phase = FAILED;
+    Serial.println("Calibration failed: " + String(reason));
+}
@@ -0,0 +1,60 @@
+#ifndef DESKCALIBRATOR
+#define DESKCALIBRATOR
+#include <Arduino.h>
+#include "deskmover.h"
+
+// DeskCalibrator measures how a desk actually moves, rather than relying on the
+// constants DeskMover starts out with. It runs one test move in each direction,
+// below 1000mm where the display reads to the mm, timing how long the desk
+// takes to react to a button press, how fast it travels, and how far it coasts
+// after the button is let go. The resulting DeskProfile is handed to the
+// DeskMover and stored in NVS, so it survives a reboot. Like DeskMover, handle
+// must be called repeatedly in the control loop while a calibration is running.
+class DeskCalibrator
+{
+public:
+    DeskCalibrator(DeskMover &deskMover);
+    static bool loadProfile(DeskProfile &profile);
+    static void saveProfile(const DeskProfile &profile);
+    bool start();
+    void abort();
+    bool isRunning();
+    bool handle(uint16_t currHeight);
+    String status();
+private:
+    enum Phase
+    {
+        IDLE,
+        STARTING,
+        POSITIONING,
+        SETTLING,
+        PRESSING,
+        COASTING,
+        DONE,
+        FAILED
+    };
+    DeskMover &deskMover;
+    volatile Phase phase;
+    DeskProfile measured;
+    const char *failReason;
+    uint8_t pass;
+    int cycles;
+    int lastChangeCycle;
+    unsigned long pressMs;
+    unsigned long firstMoveMs;
+    unsigned long lastChangeMs;
+    uint16_t prevHeight;
+    uint16_t firstMoveHeight;
+    uint16_t releaseHeight;
+    bool passIsUp();
+    void beginPositioning(uint16_t currHeight);
+    void position(uint16_t currHeight);
+    void settle(uint16_t currHeight);
+    void beginPass(uint16_t currHeight);
+    DeskProfile::Direction &passDirection();
+    void press(uint16_t currHeight);
+    void coast(uint16_t currHeight);
+    void finish();
+    void fail(const char *reason);
+};
+#endif
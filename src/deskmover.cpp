@@ -9,7 +9,11 @@ DeskMover::DeskMover(int upPin, int downPin)
       moveTickCycle(0),
       prevHeight(0),
       valueSameForNumberOfCycles(0),
-      requestedMove(false)
+      requestedMove(false),
+      progressHeight(0),
+      progressMs(0),
+      moveStartHeight(0),
+      moveStartUp(false)
 {
     pinMode(upPin, OUTPUT);
     pinMode(downPin, OUTPUT);
@@ -39,17 +43,81 @@ bool DeskMover::handle(bool manualUp, bool manualDown, uint16_t currHeight)
     else if (manualDown)
         moveDesk(false, downPin);
     else if (requestedHeight == 0 || requestedHeight == currHeight)
+    {
+        // A calibrated desk makes every move in one pass. Above 1000 the display
+        // can jump straight onto the target, so whatever coasting follows must
+        // not send us back the other way.
+        if (isCalibrated())
+            requestedHeight = 0;
         haltMovement();
+    }
     else
     {
-        uint16_t direction = (requestedHeight > currHeight) ? upPin : downPin;
+        if (moveStartHeight == 0)
+        {
+            moveStartHeight = currHeight;
+            moveStartUp = requestedHeight > currHeight;
+        }
+        bool goingUp = requestedHeight > currHeight;
+        // A calibrated desk never turns around partway through a move. Reaching
+        // or passing the target in the direction we started in ends the move.
+        if (isCalibrated() && goingUp != moveStartUp)
+        {
+            requestedHeight = 0;
+            haltMovement();
+            return deskIsMoving(currHeight);
+        }
+        const DeskProfile::Direction &dir = goingUp ? profile.up : profile.down;
         uint16_t distanceToTarget = abs(requestedHeight - currHeight);
-        bool nearingTarget = (distanceToTarget < 10) ? true : false;
-        moveDesk(nearingTarget, direction);
+        // The measured coast is what the desk does after a long move at full
+        // speed. Moves shorter than that never get up to speed, so those are
+        // made by pulsing the button the whole way instead.
+        bool shortMove = abs(requestedHeight - moveStartHeight) <= dir.coastMm;
+        bool travelling = currHeight != moveStartHeight;
+        // Once we're moving and within coasting distance, letting go of the
+        // button carries the desk the rest of the way. The request is done at
+        // that point, so we don't go hunting back and forth around the target.
+        bool slow = shortMove || distanceToTarget < profile.slowZoneMm;
+        if ((!shortMove && travelling && distanceToTarget <= dir.coastMm) || moveStalled(dir, currHeight, slow))
+        {
+            requestedHeight = 0;
+            haltMovement();
+        }
+        else
+            moveDesk(slow, goingUp ? upPin : downPin);
     }
     return deskIsMoving(currHeight);
 }
 
+// Decides whether a move towards a requested height has stopped making
+// progress, for example because the frame can't reach the requested height or
+// something is in the way. This needs a measured speed to know how long a
+// height change should take, so it never triggers on an uncalibrated desk.
+bool DeskMover::moveStalled(const DeskProfile::Direction &dir, uint16_t currHeight, bool slow)
+{
+    if (dir.speed == 0)
+        return false;
+
+    if (currHeight != progressHeight)
+    {
+        progressHeight = currHeight;
+        progressMs = millis();
+        return false;
+    }
+
+    // The display only changes every 10mm above 1000, so allow for two of those
+    // steps on top of the time the desk takes to start moving.
+    unsigned long timeoutMs = dir.startLagMs + 2 * (10 * 10 * 1000UL / dir.speed);
+    // Pulsing the button only moves the desk half the time.
+    if (slow)
+        timeoutMs *= 2;
+    if (millis() - progressMs < timeoutMs)
+        return false;
+
+    Serial.println("Desk stopped moving at " + String(currHeight) + "mm, giving up");
+    return true;
+}
+
 // Sets a specific target height to achieve.
 void DeskMover::requestHeight(uint16_t height)
 {
@@ -61,6 +129,27 @@ void DeskMover::requestHeight(uint16_t height)
         height -= (height % 10);
     Serial.println("Requested height: " + String(height) + "mm");
     requestedHeight = height;
+    progressHeight = 0;
+    progressMs = millis();
+    moveStartHeight = 0;
+}
+
+// Replaces the assumptions about how the desk moves, usually with a profile
+// that DeskCalibrator measured.
+void DeskMover::setProfile(const DeskProfile &newProfile)
+{
+    profile = newProfile;
+}
+
+const DeskProfile &DeskMover::getProfile()
+{
+    return profile;
+}
+
+// An uncalibrated desk has no measured speeds, see DeskProfile.
+bool DeskMover::isCalibrated()
+{
+    return profile.up.speed != 0 && profile.down.speed != 0;
 }
 
 // Immediately halts any movement by setting both pins to LOW.
@@ -98,9 +187,9 @@ bool DeskMover::deskIsMoving(uint16_t currHeight)
 
     // If we see the same height for a number of cycles, we're done moving.
     valueSameForNumberOfCycles++;
-    // 25 implies 1.5 seconds of no movement. Should be long enough to assume
-    // we're done.
-    bool stillMoving = (valueSameForNumberOfCycles > 25) ? false : true;
+    // The default of 25 implies 1.5 seconds of no movement. Should be long
+    // enough to assume we're done.
+    bool stillMoving = (valueSameForNumberOfCycles > profile.settleCycles) ? false : true;
     if (stillMoving)
     {
         Serial.print(".");
@@ -140,4 +229,12 @@ void DeskMover::moveDesk(bool nearingTarget, int pin)
 void DeskMover::wakeDesk()
 {
     digitalWrite(downPin, HIGH);
+}
+
+// Holds down one of the desk buttons until haltMovement is called. Used by
+// DeskCalibrator, which needs to time the desk's response to a plain press.
+void DeskMover::holdButton(bool up)
+{
+    digitalWrite(up ? upPin : downPin, HIGH);
+    digitalWrite(up ? downPin : upPin, LOW);
 }
\ No newline at end of file
@@ -2,6 +2,27 @@
 #define DESKMOVER
 #include <Arduino.h>
 
+// DeskProfile describes how a particular desk frame behaves when its buttons are
+// pressed. The defaults reproduce the original hard-coded behaviour, which works
+// well enough on an uncalibrated desk. DeskCalibrator replaces them with values
+// measured on the actual frame.
+struct DeskProfile
+{
+    struct Direction
+    {
+        // Travel speed in tenths of a mm per second. 0 means it is unknown.
+        uint16_t speed = 0;
+        // Time between pressing the button and the height first changing.
+        uint16_t startLagMs = 0;
+        // Distance the desk keeps travelling after the button is released.
+        uint8_t coastMm = 0;
+    } up, down;
+    // Within this distance of the target the button is pulsed to slow down.
+    uint8_t slowZoneMm = 10;
+    // Cycles of unchanged height before a move is considered done.
+    uint8_t settleCycles = 25;
+};
+
 class DeskMover
 {
 public:
@@ -10,7 +31,10 @@ public:
     bool handle(bool manualUp, bool manualDown, uint16_t currHeight);
     void requestHeight(uint16_t height);
     void wakeDesk();
+    void holdButton(bool up);
     void haltMovement();
+    void setProfile(const DeskProfile &newProfile);
+    const DeskProfile &getProfile();
 private:
     uint16_t requestedHeight;
     bool moveTickCycle;
@@ -19,8 +43,15 @@ private:
     bool requestedMove;
     int upPin;
     int downPin;
+    DeskProfile profile;
+    uint16_t progressHeight;
+    unsigned long progressMs;
+    uint16_t moveStartHeight;
+    bool moveStartUp;
     void moveDesk(bool slow, int pin);
     bool deskIsMoving(uint16_t currHeight);
+    bool moveStalled(const DeskProfile::Direction &dir, uint16_t currHeight, bool slow);
+    bool isCalibrated();
 
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,126 @@
+#include <Arduino.h>
+#include "deskmqtt.h"
+
+// How long to wait between attempts to reach the broker.
+#define MQTT_RECONNECT_INTERVAL_MS 10000
+// Keep alive interval in seconds. An idle desk sends nothing but these pings.
+#define MQTT_KEEP_ALIVE 60
+
+DeskMqtt::DeskMqtt(unsigned long minIntervalMs)
+    : onHeightRequest(nullptr),
+      minIntervalMs(minIntervalMs),
+      lastPublishMs(0),
+      lastConnectAttemptMs(0),
+      justConnected(false),
+      statePublished(false),
+      publishedHeight(0),
+      publishedMoving(false)
+{
+}
+
+// Sets up the client and makes the first attempt to connect. WiFi must already
+// be connected. Height requests received on the command topic are passed to
+// onHeightRequest.
+void DeskMqtt::begin(const char *host, uint16_t port, const String &baseTopic, HeightRequestHandler onHeightRequest)
+{
+    this->onHeightRequest = onHeightRequest;
+    clientId = baseTopic;
+    clientId.replace('/', '-');
+    stateTopic = baseTopic + "/state";
+    availabilityTopic = baseTopic + "/availability";
+    commandTopic = baseTopic + "/set";
+
+    // The client keeps pointers to these rather than copying them, which is
+    // why they're members.
+    client.setServer(host, port);
+    client.setClientId(clientId.c_str());
+    client.setKeepAlive(MQTT_KEEP_ALIVE);
+    client.setWill(availabilityTopic.c_str(), 1, true, "offline");
+
+    // These are called from the AsyncTCP task, so the connect handler only
+    // leaves a note for update to act on from the control loop.
+    client.onConnect([this](bool sessionPresent)
+                     { justConnected = true; });
+    client.onMessage([this](char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)
+                     { handleMessage(topic, payload, properties.retain, len, index, total); });
+
+    Serial.println("Connecting to MQTT broker at " + String(host));
+    lastConnectAttemptMs = millis();
+    client.connect();
+}
+
+// To be called repeatedly in the loop function with the current state of the
+// desk. Publishes it if it has changed and enough time has passed since the
+// last publish, and keeps the connection to the broker alive.
+void DeskMqtt::update(uint16_t height, bool moving)
+{
+    if (!client.connected())
+    {
+        if (millis() - lastConnectAttemptMs > MQTT_RECONNECT_INTERVAL_MS)
+        {
+            lastConnectAttemptMs = millis();
+            client.connect();
+        }
+        return;
+    }
+
+    if (justConnected)
+    {
+        justConnected = false;
+        announce();
+    }
+
+    // We never had a valid height, so there is nothing useful to say.
+    if (height == 0)
+        return;
+    if (statePublished && height == publishedHeight && moving == publishedMoving)
+        return;
+    if (statePublished && millis() - lastPublishMs < minIntervalMs)
+        return;
+
+    String state = "{\"height\":";
+    state += height;
+    state += ",\"moving\":";
+    state += moving ? "true" : "false";
+    state += "}";
+    // A failed publish returns 0, in which case we'll try again next time.
+    if (client.publish(stateTopic.c_str(), 0, true, state.c_str()) == 0)
+        return;
+
+    statePublished = true;
+    publishedHeight = height;
+    publishedMoving = moving;
+    lastPublishMs = millis();
+}
+
+// Called once per connection to the broker. A new connection might be to a
+// broker that lost its retained messages, so the state is published again too.
+void DeskMqtt::announce()
+{
+    Serial.println("Connected to MQTT broker");
+    client.publish(availabilityTopic.c_str(), 1, true, "online");
+    client.subscribe(commandTopic.c_str(), 1);
+    statePublished = false;
+}
+
+void DeskMqtt::handleMessage(char *topic, char *payload, bool retained, size_t len, size_t index, size_t total)
+{
+    // The broker replays retained messages every time we subscribe, which
+    // would send the desk back to some old height after every reconnect.
+    if (retained)
+        return;
+
+    // A height is only ever a few bytes, so anything split up is not for us.
+    if (commandTopic != topic || index != 0 || len != total || len > 8)
+        return;
+
+    // The payload isn't null terminated.
+    char height[9];
+    memcpy(height, payload, len);
+    height[len] = '\0';
+    int requested = atoi(height);
+    if (requested <= 0)
+        return;
+    Serial.println("MQTT height request: " + String(requested) + "mm");
+    onHeightRequest(requested);
+}
@@ -0,0 +1,40 @@
+#ifndef DESKMQTT
+#define DESKMQTT
+#include <Arduino.h>
+#include <AsyncMqttClient.h>
+
+// DeskMqtt publishes the state of the desk to an MQTT broker, so that home
+// automation doesn't need to poll the HTTP API. The state is a retained message
+// that is only published when it changes, and at most once per minIntervalMs;
+// changes in between are folded into the next message. Height requests arrive
+// on a command topic, and availability is tracked with a Last Will. Topics live
+// under a base topic:
+//   <base>/state         {"height":780,"moving":false} (retained)
+//   <base>/availability  online or offline (retained)
+//   <base>/set           a height in mm to move to (not retained)
+// update must be called repeatedly in the control loop.
+class DeskMqtt
+{
+public:
+    typedef String (*HeightRequestHandler)(int height);
+    DeskMqtt(unsigned long minIntervalMs);
+    void begin(const char *host, uint16_t port, const String &baseTopic, HeightRequestHandler onHeightRequest);
+    void update(uint16_t height, bool moving);
+private:
+    AsyncMqttClient client;
+    String clientId;
+    String stateTopic;
+    String availabilityTopic;
+    String commandTopic;
+    HeightRequestHandler onHeightRequest;
+    unsigned long minIntervalMs;
+    unsigned long lastPublishMs;
+    unsigned long lastConnectAttemptMs;
+    volatile bool justConnected;
+    bool statePublished;
+    uint16_t publishedHeight;
+    bool publishedMoving;
+    void announce();
+    void handleMessage(char *topic, char *payload, bool retained, size_t len, size_t index, size_t total);
+};
+#endif
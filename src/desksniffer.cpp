@@ -16,12 +16,22 @@
 #include "desksniffer.h"
 #include "deskheight.h"
 #include "deskmover.h"
+#include "deskcalibrator.h"
+#include "deskmqtt.h"
 #include "manualcontrols.h"
 
 const char *SSID = "SomeSSID";
 const char *PWD = "SomePassword";
 AsyncWebServer server(80);
 
+// The MQTT broker to publish the desk's state to. Each desk publishes under
+// desksniffer/<mac address>, so the same firmware can go on every desk.
+const char *MQTT_HOST = "192.168.1.2";
+const uint16_t MQTT_PORT = 1883;
+// The least amount of time between two state messages. Changes that happen in
+// between are rolled into the next message.
+const unsigned long MQTT_MIN_INTERVAL_MS = 1000;
+
 // The i2c pins on the AiP650EO
 #define PIN_SDA 12
 #define PIN_SCL 13
@@ -40,7 +50,9 @@ bool deskBooted = false;
 bool moveRequested = false;
 
 DeskMover deskMover(PIN_UP, PIN_DOWN);
+DeskCalibrator deskCalibrator(deskMover);
 ManualControls manualControls(PIN_BUTTON_UP, PIN_BUTTON_DOWN);
+DeskMqtt deskMqtt(MQTT_MIN_INTERVAL_MS);
 
 void connectToWiFi()
 {
@@ -71,11 +83,21 @@ String currentHeight()
 // HTTP handler that sets a requested height and returns OK
 String requestHeight(int height)
 {
+	if (deskCalibrator.isRunning())
+		return "BUSY";
 	moveRequested = true;
 	deskMover.requestHeight(height);
 	return "OK";
 }
 
+// HTTP handler that starts a calibration run and returns OK
+String startCalibration()
+{
+	if (!deskBooted || moveRequested || !deskCalibrator.start())
+		return "BUSY";
+	return "OK";
+}
+
 // HTTP handler for 404
 void notFound(AsyncWebServerRequest *request)
 {
@@ -91,11 +113,25 @@ void setup()
 	DeskHeight::initialize(PIN_SDA, PIN_SCL);
 	deskMover.initialize();
 
+	DeskProfile profile;
+	if (DeskCalibrator::loadProfile(profile))
+	{
+		deskMover.setProfile(profile);
+		Serial.println("Loaded calibrated desk profile");
+	}
+
 	// For unimplemented button just yet, just setting the pin as an input to prevent floating.
 	pinMode(PIN_BUTTON_MIDDLE, INPUT_PULLUP);
 
 	connectToWiFi();
 
+	// HTTP handler that starts a calibration run, and one that reports on it.
+	// These go first, since the /desk handler also matches anything below it.
+	server.on("/desk/calibrate", HTTP_GET, [](AsyncWebServerRequest *request)
+			  { request->send(200, "text/plain", startCalibration()); });
+	server.on("/desk/calibration", HTTP_GET, [](AsyncWebServerRequest *request)
+			  { request->send(200, "text/plain", deskCalibrator.status()); });
+
 	// HTTP handler that either returns the current height or sets a new height
 	server.on("/desk", HTTP_GET, [](AsyncWebServerRequest *request)
 			  { 
@@ -106,6 +142,12 @@ void setup()
 
 	server.onNotFound(notFound);
 	server.begin();
+
+	// Height requests over MQTT go through the same handler as HTTP ones.
+	String mac = WiFi.macAddress();
+	mac.replace(":", "");
+	mac.toLowerCase();
+	deskMqtt.begin(MQTT_HOST, MQTT_PORT, "desksniffer/" + mac, requestHeight);
 	Serial.println("Successfully initialized. Letsa goooo!");
 }
 
@@ -115,8 +157,21 @@ void loop()
 	// since apparently the desk doesn't like it when you rapidly press buttons extremely fast.
 	delay(50);
 	DeskHeight::recv();
+	deskMqtt.update(DeskHeight::getLastKnownHeight(), moveRequested || deskCalibrator.isRunning());
 
 	int manualControlEngaged = manualControls.handleButtons();
+
+	// A calibration run has the desk to itself, unless someone grabs the
+	// manual controls, in which case we bail out and let them have it.
+	if (deskCalibrator.isRunning())
+	{
+		if (manualControlEngaged == 0)
+		{
+			deskCalibrator.handle(DeskHeight::getLastKnownHeight());
+			return;
+		}
+		deskCalibrator.abort();
+	}
 	if (manualControlEngaged != 0)
 		moveRequested = true;
 	
@@ -5,6 +5,7 @@
 void connectToWiFi();
 String currentHeight();
 String requestHeight(int height);
+String startCalibration();
 void notFound(AsyncWebServerRequest *request);
 void setup();
 void loop();